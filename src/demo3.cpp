@@ -36,22 +36,26 @@ namespace Messages {
 class Logger {
 public:
     explicit Logger(std::shared_ptr<Cfabric::Broker<Messages::MessageVariants>> broker) {
-        broker->subscribe<Messages::SourceMessage>([this](const Messages::SourceMessage& msg) {
-            spdlog::info("Logger: tracing SourceMessage {}", msg.content);
-            });
-        broker->subscribe<Messages::LogOnlyMessage>([this](const Messages::LogOnlyMessage& msg) {
-            spdlog::info("Logger: tracing LogOnlyMessage: {}", msg.content);
-        });
-        broker->subscribe<Messages::ProcessedMessage>([this](const Messages::ProcessedMessage& msg) {
-            spdlog::info("Logger: tracing ProcessedMessage {}", msg.content);
-        });
-        broker->subscribe<Messages::StopSignal>([this](const Messages::StopSignal& msg) {
-            spdlog::info("Logger: Received stop signal");
+        // a single wiretap sees every message type; no need to subscribe to each type separately
+        broker->subscribe_all([](const Messages::MessageVariants& msg) {
+            std::visit([](const auto& concrete_msg) { trace(concrete_msg); }, msg);
         });
     }
 
 private:
-    // Logger does not need to do anything with the messages
+    // one overload per message type; std::visit above picks the matching one
+    static void trace(const Messages::SourceMessage& msg) {
+        spdlog::info("Logger: tracing SourceMessage {}", msg.content);
+    }
+    static void trace(const Messages::LogOnlyMessage& msg) {
+        spdlog::info("Logger: tracing LogOnlyMessage: {}", msg.content);
+    }
+    static void trace(const Messages::ProcessedMessage& msg) {
+        spdlog::info("Logger: tracing ProcessedMessage {}", msg.content);
+    }
+    static void trace(const Messages::StopSignal& msg) {
+        spdlog::info("Logger: Received stop signal");
+    }
 };
 
 
@@ -71,9 +75,12 @@ public:
 
     void processAndPublish(const std::string& data) {
         spdlog::info("DataProcessor: Processing data: {}", data);
-        std::string processed_data = "Processed: " + data;
-        spdlog::info("DataProcessor: Publishing processed data: {}", processed_data);
-        m_broker->publish(Messages::ProcessedMessage(processed_data));
+        // the processed message is only built if someone listens to it
+        m_broker->publish_lazy<Messages::ProcessedMessage>([&data] {
+            std::string processed_data = "Processed: " + data;
+            spdlog::info("DataProcessor: Publishing processed data: {}", processed_data);
+            return Messages::ProcessedMessage(processed_data);
+        });
     }
 
 private:
@@ -7,7 +7,35 @@
 #include <functional>
 #include <list>
 #include <typeindex>
+#include <typeinfo>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <deque>
+#include <exception>
+#include <cstring>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
 
 #include <spdlog/spdlog.h>
 
@@ -52,63 +80,1295 @@ namespace Cfabric {
                 return false;
             }
         }
+
+        // Helper to stop template argument deduction (std::type_identity, before C++20)
+        template<typename T>
+        struct type_identity {
+            using type = T;
+        };
+
+        // Helper to get the position of a type in a variant
+        template<typename T, typename Variant>
+        struct variant_index;
+
+        template<typename T, typename... Ts>
+        struct variant_index<T, std::variant<Ts...>> {
+            static constexpr std::size_t find() {
+                constexpr bool matches[] = {std::is_same<T, Ts>::value...};
+                for (std::size_t i = 0; i < sizeof...(Ts); ++i) {
+                    if (matches[i]) return i;
+                }
+                return sizeof...(Ts);
+            }
+            static constexpr std::size_t value = find();
+        };
     }
 
+    //! DispatcherConfig - where the dispatcher thread runs, and how it waits for work.
+    //! The defaults park the thread on a condition variable as soon as the queue is empty. That is cheap on CPU,
+    //! but every wake-up is a futex call and a reschedule, which typically costs tens of microseconds.
+    //! For latency-critical pipelines, pin the thread to an isolated core and let it busy-poll; see low_latency().
+    struct DispatcherConfig {
+        static constexpr std::size_t never_park = static_cast<std::size_t>(-1);
+
+        //! queue slots, rounded up to a power of two. When the queue is full, the publisher waits for room.
+        std::size_t capacity = 1024;
+        //! cores that the dispatcher thread is allowed to run on; empty means "let the OS decide". Linux only.
+        std::vector<int> cpu_affinity;
+        //! empty polls (each followed by a `pause`) before the thread parks. 0 parks immediately; never_park is a pure busy-poll.
+        std::size_t spins_before_park = 0;
+        //! mlock() the queue, so that the hot path never page-faults, nor gets swapped out. Linux only; needs RLIMIT_MEMLOCK.
+        bool lock_memory = false;
+
+        static DispatcherConfig low_latency(std::vector<int> cores = {}) {
+            DispatcherConfig config;
+            config.cpu_affinity = std::move(cores);
+            config.spins_before_park = never_park;
+            config.lock_memory = true;
+            return config;
+        }
+    };
+
+    namespace Static {
+        //! spin-wait hint: lets the sibling hyper-thread run, and saves power, without giving up the core
+        inline void cpu_relax() {
+            #if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+            #elif defined(__aarch64__) || defined(__arm__)
+            asm volatile("yield");
+            #endif
+        }
+
+        inline std::size_t round_up_to_power_of_two(std::size_t n) {
+            std::size_t result = 1;
+            while (result < n) result <<= 1;
+            return result;
+        }
+    }
+
+    //! Dispatcher - a worker thread that owns a queue, and calls the handler for each queued item.
+    //! This is the asynchronous delivery path: the publisher only pays for the move into the queue,
+    //! and the (possibly slow) handler runs on the dispatcher's own thread.
+    //!
+    //! The queue is a bounded, lock-free, multi-producer ring (D. Vyukov's design) that is allocated, and touched,
+    //! up front. Publishers only take a lock to wake the dispatcher thread if it has parked.
+    //! The destructor delivers whatever is still queued, and then joins the thread.
+    //! Do not push into a dispatcher from its own handler: with a full queue, that would wait forever.
+    template<typename ItemT>
+    class Dispatcher {
+        public:
+            using HandlerFunction = std::function<void(ItemT&)>;
+
+            explicit Dispatcher(HandlerFunction handler, const DispatcherConfig& config = DispatcherConfig())
+                : handler(std::move(handler)),
+                  config(config),
+                  mask(Static::round_up_to_power_of_two(config.capacity > 1 ? config.capacity : 2) - 1),
+                  cells(new Cell[mask + 1]) {
+                // constructing the cells has already written to every page of the ring; now optionally pin it in RAM
+                for (std::size_t i = 0; i <= mask; ++i) {
+                    cells[i].sequence.store(i, std::memory_order_relaxed);
+                }
+                if (config.lock_memory) {
+                    #ifdef __linux__
+                    memory_locked = mlock(cells.get(), sizeof(Cell) * (mask + 1)) == 0;
+                    if (!memory_locked) {
+                        SPDLOG_WARN("Dispatcher: mlock of the queue failed, errno {}", errno);
+                    }
+                    #endif
+                }
+                thread = std::thread(&Dispatcher::run, this);
+            }
+
+            ~Dispatcher() {
+                running.store(false, std::memory_order_release);
+                wake();
+                if (thread.joinable()) {
+                    thread.join();
+                }
+                #ifdef __linux__
+                if (memory_locked) {
+                    munlock(cells.get(), sizeof(Cell) * (mask + 1));
+                }
+                #endif
+            }
+
+            Dispatcher(const Dispatcher&) = delete;
+            Dispatcher& operator=(const Dispatcher&) = delete;
+
+            //! waits for room if the queue is full
+            void push(ItemT item) {
+                while (!try_push(std::move(item))) {
+                    // full: wait for the dispatcher thread to make room
+                    std::this_thread::yield();
+                }
+            }
+
+            //! returns false, and leaves item as it was, if the queue is full
+            bool try_push(ItemT&& item) {
+                Cell* cell;
+                std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+                while (true) {
+                    cell = &cells[pos & mask];
+                    const std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                    const auto diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+                    if (diff == 0) {
+                        if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+                    } else if (diff < 0) {
+                        return false;
+                    } else {
+                        pos = enqueue_pos.load(std::memory_order_relaxed);
+                    }
+                }
+                new (&cell->storage) ItemT(std::move(item));
+                cell->sequence.store(pos + 1, std::memory_order_release);
+
+                // pairs with the fence in park(): either the dispatcher sees the new item, or we see that it has parked
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (parked.load(std::memory_order_relaxed)) {
+                    wake();
+                }
+                return true;
+            }
+
+            //! bytes of ring per queued item
+            static constexpr std::size_t slot_size() {
+                return sizeof(Cell);
+            }
+
+            //! blocks until everything pushed so far has been handled. Do not call from within the handler.
+            void flush() {
+                // slots are claimed, and handled, in order; so once this many are handled, every item pushed before this call
+                // is done - including those whose producers have claimed a slot but are still writing to it
+                const std::size_t target = enqueue_pos.load(std::memory_order_acquire);
+                if (config.spins_before_park == DispatcherConfig::never_park) {
+                    while (processed.load(std::memory_order_acquire) < target) {
+                        std::this_thread::yield();
+                    }
+                    return;
+                }
+                flush_waiters.fetch_add(1, std::memory_order_seq_cst);
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    drained.wait(lock, [this, target] { return processed.load(std::memory_order_seq_cst) >= target; });
+                }
+                flush_waiters.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+        private:
+            //! packed, with no padding to a cache line: a ring of small items stays small, at the price of some false sharing
+            //! between producer and consumer while the queue is nearly empty. Only the two indices below get a line each.
+            struct Cell {
+                std::atomic<std::size_t> sequence{0};
+                typename std::aligned_storage<sizeof(ItemT), alignof(ItemT)>::type storage;
+            };
+
+            bool has_work() const {
+                return cells[dequeue_pos & mask].sequence.load(std::memory_order_acquire) == dequeue_pos + 1;
+            }
+
+            //! only ever called from the dispatcher thread, so the consumer side needs no CAS
+            bool handle_one() {
+                if (!has_work()) return false;
+                Cell& cell = cells[dequeue_pos & mask];
+                ItemT* item = std::launder(reinterpret_cast<ItemT*>(&cell.storage));
+                handler(*item);
+                item->~ItemT();
+                cell.sequence.store(dequeue_pos + mask + 1, std::memory_order_release);
+                ++dequeue_pos;
+                // seq_cst pairs with flush(): either it sees the new count, or we see that it is waiting
+                processed.store(dequeue_pos, std::memory_order_seq_cst);
+                if (flush_waiters.load(std::memory_order_seq_cst) > 0) {
+                    { std::lock_guard<std::mutex> guard(mutex); }
+                    drained.notify_all();
+                }
+                return true;
+            }
+
+            void park() {
+                std::unique_lock<std::mutex> lock(mutex);
+                parked.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                awaiter.wait(lock, [this] { return has_work() || !running.load(std::memory_order_acquire); });
+                parked.store(false, std::memory_order_relaxed);
+            }
+
+            void wake() {
+                { std::lock_guard<std::mutex> guard(mutex); }
+                awaiter.notify_one();
+            }
+
+            void pin_thread() {
+                if (config.cpu_affinity.empty()) return;
+                #ifdef __linux__
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                for (int core : config.cpu_affinity) {
+                    CPU_SET(core, &cpus);
+                }
+                int result = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+                if (result != 0) {
+                    SPDLOG_WARN("Dispatcher: could not pin the thread to the requested cores, error {}", result);
+                }
+                #else
+                SPDLOG_WARN("Dispatcher: cpu_affinity is only supported on Linux");
+                #endif
+            }
+
+            void run() {
+                pin_thread();
+                std::size_t idle_spins = 0;
+                while (true) {
+                    if (handle_one()) {
+                        idle_spins = 0;
+                        continue;
+                    }
+                    if (!running.load(std::memory_order_acquire)) {
+                        if (has_work()) continue;
+                        break; // stopped, and nothing left to deliver
+                    }
+                    if (config.spins_before_park == DispatcherConfig::never_park || idle_spins < config.spins_before_park) {
+                        ++idle_spins;
+                        Static::cpu_relax();
+                        continue;
+                    }
+                    park();
+                    idle_spins = 0;
+                }
+            }
+
+            HandlerFunction handler;
+            const DispatcherConfig config;
+            const std::size_t mask;
+            std::unique_ptr<Cell[]> cells;
+            bool memory_locked = false;
+
+            alignas(64) std::atomic<std::size_t> enqueue_pos{0};
+            alignas(64) std::size_t dequeue_pos = 0;
+            std::atomic<std::size_t> processed{0};
+            std::atomic<int> flush_waiters{0};
+            std::atomic<bool> parked{false};
+            std::atomic<bool> running{true};
+
+            std::mutex mutex;
+            std::condition_variable awaiter;
+            std::condition_variable drained;
+            std::thread thread;
+    };
+
+    //! Sampling - decides how many of the messages a wiretap (see Broker::subscribe_all) gets to see.
+    //! Both limits can be combined; the 1-in-N filter is applied first.
+    struct Sampling {
+        std::uint64_t every_nth = 1;   //!< see only every N-th message; 1 means every message
+        double max_per_second = 0.0;   //!< token bucket refill rate; 0 disables the bucket
+        double burst = 1.0;            //!< token bucket depth, in messages
+
+        static Sampling one_in(std::uint64_t n) {
+            Sampling sampling;
+            sampling.every_nth = n;
+            return sampling;
+        }
+
+        static Sampling rate(double per_second, double burst = 1.0) {
+            Sampling sampling;
+            sampling.max_per_second = per_second;
+            sampling.burst = burst;
+            return sampling;
+        }
+    };
+
+    //! TapOptions - how a wiretap is to be fed.
+    struct TapOptions {
+        Sampling sampling;
+        //! if set, the tap runs on its own dispatcher thread and the publisher only pays for a copy of the message
+        bool async = false;
+        //! the dispatcher thread used when async is set
+        DispatcherConfig dispatcher;
+        //! when an async tap's queue is full: by default the message is dropped, and counted (see Broker::tap_dropped),
+        //! so that a slow tap never holds up the publishers. Set this to have the publisher wait for room instead.
+        bool block_when_full = false;
+    };
+
+    //! Sampler - lock-free state for Sampling; safe to use from many publishing threads at once.
+    //! The token bucket is implemented as GCRA (a "virtual scheduling" bucket) so that it is a single CAS on an integer.
+    class Sampler {
+        public:
+            explicit Sampler(const Sampling& sampling)
+                : every_nth(sampling.every_nth > 1 ? sampling.every_nth : 1) {
+                if (sampling.max_per_second > 0.0) {
+                    interval_ns = static_cast<std::int64_t>(1e9 / sampling.max_per_second);
+                    if (interval_ns < 1) interval_ns = 1;
+                    double burst = sampling.burst > 1.0 ? sampling.burst : 1.0;
+                    tolerance_ns = static_cast<std::int64_t>((burst - 1.0) * static_cast<double>(interval_ns));
+                }
+            }
+
+            bool admit() {
+                if (every_nth > 1 && counter.fetch_add(1, std::memory_order_relaxed) % every_nth != 0) {
+                    return false;
+                }
+                if (interval_ns == 0) {
+                    return true;
+                }
+                const std::int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count();
+                std::int64_t tat = theoretical_arrival.load(std::memory_order_relaxed);
+                std::int64_t next;
+                do {
+                    const std::int64_t start = tat > now ? tat : now;
+                    if (start - now > tolerance_ns) {
+                        return false; // bucket is empty
+                    }
+                    next = start + interval_ns;
+                } while (!theoretical_arrival.compare_exchange_weak(tat, next, std::memory_order_relaxed));
+                return true;
+            }
+
+        private:
+            std::uint64_t every_nth;
+            std::int64_t interval_ns = 0;
+            std::int64_t tolerance_ns = 0;
+            std::atomic<std::uint64_t> counter{0};
+            std::atomic<std::int64_t> theoretical_arrival{0};
+    };
+
+    //! SlotPool - free lists of blocks for one message type; the out-of-line storage behind CompactMessage.
+    //! Blocks are recycled, not returned to the system, so after warm-up the steady state does no heap allocation.
+    //!
+    //! Typically one thread allocates (the publisher) and another releases (a dispatcher), so neither side takes a lock:
+    //! release() pushes onto a shared lock-free stack, and allocate() serves from a per-thread list, which it refills by
+    //! taking the whole shared stack in one exchange. (Only ever pushing one and taking all keeps the stack free of ABA.)
+    //! The shared stack is intentionally leaked, so that it outlives every CompactMessage, including those held in statics.
+    template<typename T>
+    class SlotPool {
+        public:
+            static void* allocate() {
+                LocalList& local = local_list();
+                if (!local.head) {
+                    local.head = shared_stack().exchange(nullptr, std::memory_order_acquire);
+                }
+                if (Block* block = local.head) {
+                    local.head = block->next;
+                    return &block->storage;
+                }
+                return &(new Block)->storage;
+            }
+
+            static void release(void* storage) {
+                Block* block = reinterpret_cast<Block*>(storage);
+                push_shared(block, block);
+            }
+
+        private:
+            union Block {
+                Block* next;
+                typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+            };
+
+            //! blocks that this thread may hand out without synchronization; given back to the shared stack at thread exit
+            struct LocalList {
+                Block* head = nullptr;
+
+                ~LocalList() {
+                    if (!head) return;
+                    Block* tail = head;
+                    while (tail->next) tail = tail->next;
+                    push_shared(head, tail);
+                }
+            };
+
+            static std::atomic<Block*>& shared_stack() {
+                static auto* stack = new std::atomic<Block*>(nullptr);
+                return *stack;
+            }
+
+            static LocalList& local_list() {
+                static thread_local LocalList list;
+                return list;
+            }
+
+            //! pushes the chain first..last (linked through next) onto the shared stack
+            static void push_shared(Block* first, Block* last) {
+                std::atomic<Block*>& stack = shared_stack();
+                Block* head = stack.load(std::memory_order_relaxed);
+                do {
+                    last->next = head;
+                } while (!stack.compare_exchange_weak(head, first, std::memory_order_release, std::memory_order_relaxed));
+            }
+    };
+
+    //! CompactMessage - a smaller stand-in for the message variant, for use in queues, rings and buffers.
+    //! A std::variant is as large as its largest alternative, so a single message with two strings makes every
+    //! empty signal 70+ bytes too. Here, small trivially copyable alternatives are stored inline, and all the others
+    //! are moved into a pooled block (see SlotPool) behind a pointer. With the default 24 inline bytes, a CompactMessage is 32 bytes.
+    //!
+    //! The placement of each alternative is known at compile time: see stored_inline<T> and layout,
+    //! e.g. `static_assert(CompactMessage<MyVariants>::stored_inline<MyHotMessage>)`. layout_report() prints it.
+    template<typename MessageVariantsT, std::size_t InlineBytes = 24>
+    class CompactMessage;
+
+    template<typename... Ts, std::size_t InlineBytes>
+    class CompactMessage<std::variant<Ts...>, InlineBytes> {
+        public:
+            using MessageVariantsT = std::variant<Ts...>;
+
+            static_assert(InlineBytes >= sizeof(void*), "CompactMessage needs at least room for a pointer inline");
+
+            //! no more than a pointer or a 64-bit number needs, so that, with its index byte, a CompactMessage is not padded
+            //! past InlineBytes + 8 - and a queue cell with its 8-byte sequence number is then 40 bytes, rather than 48
+            static constexpr std::size_t inline_alignment = alignof(std::uint64_t) > alignof(void*) ? alignof(std::uint64_t) : alignof(void*);
+            static_assert(sizeof...(Ts) < 255, "CompactMessage supports up to 254 message types");
+
+            template<typename T>
+            static constexpr bool stored_inline = std::is_trivially_copyable<T>::value
+                    && sizeof(T) <= InlineBytes
+                    && alignof(T) <= inline_alignment;
+
+            struct Placement {
+                std::size_t size;
+                std::size_t alignment;
+                bool stored_inline;
+            };
+            //! size, alignment and placement of each alternative, in the order of the variant
+            static constexpr Placement layout[] = {{sizeof(Ts), alignof(Ts), stored_inline<Ts>}...};
+
+            static std::string layout_report() {
+                const char* names[] = {typeid(Ts).name()...};
+                std::string report = fmt::format("CompactMessage: {} bytes (the variant: {} bytes)\n",
+                                                 sizeof(CompactMessage), sizeof(MessageVariantsT));
+                for (std::size_t i = 0; i < sizeof...(Ts); ++i) {
+                    report += fmt::format("  {:>3} bytes  {:<6}  {}\n", layout[i].size,
+                                          layout[i].stored_inline ? "inline" : "pooled", names[i]);
+                }
+                return report;
+            }
+
+            CompactMessage(const MessageVariantsT& msg) {
+                std::visit([this](const auto& concrete_msg) { emplace(concrete_msg); }, msg);
+            }
+
+            CompactMessage(MessageVariantsT&& msg) {
+                std::visit([this](auto& concrete_msg) { emplace(std::move(concrete_msg)); }, msg);
+            }
+
+            template<typename T, typename = std::enable_if_t<Static::check_type_in_variant<std::decay_t<T>, MessageVariantsT>()>>
+            CompactMessage(T&& msg) {
+                emplace(std::forward<T>(msg));
+            }
+
+            CompactMessage(const CompactMessage& other) {
+                if (!other.valueless()) copy_table[other.index_](*this, other);
+            }
+
+            CompactMessage(CompactMessage&& other) noexcept {
+                steal(other);
+            }
+
+            CompactMessage& operator=(const CompactMessage& other) {
+                if (this != &other) {
+                    reset();
+                    if (!other.valueless()) copy_table[other.index_](*this, other);
+                }
+                return *this;
+            }
+
+            CompactMessage& operator=(CompactMessage&& other) noexcept {
+                if (this != &other) {
+                    reset();
+                    steal(other);
+                }
+                return *this;
+            }
+
+            ~CompactMessage() {
+                reset();
+            }
+
+            //! same as std::variant::index(); std::variant_npos after having been moved from
+            std::size_t index() const {
+                return valueless() ? std::variant_npos : index_;
+            }
+
+            template<typename T>
+            const T* get_if() const {
+                constexpr std::size_t i = Static::variant_index<T, MessageVariantsT>::value;
+                static_assert(i < sizeof...(Ts), "T must be one of the types in MsgTypesT variant.");
+                return index_ == i ? &get<T>() : nullptr;
+            }
+
+            //! calls the visitor with the stored alternative, like std::visit
+            template<typename Visitor>
+            decltype(auto) visit(Visitor&& visitor) const {
+                using ResultT = std::invoke_result_t<Visitor&, const std::variant_alternative_t<0, MessageVariantsT>&>;
+                using VisitFunction = ResultT (*)(const CompactMessage&, Visitor&);
+                static constexpr VisitFunction visit_table[] = {&visit_one<Ts, Visitor, ResultT>...};
+                if (valueless()) throw std::bad_variant_access();
+                return visit_table[index_](*this, visitor);
+            }
+
+            MessageVariantsT to_variant() const {
+                return visit([](const auto& concrete_msg) { return MessageVariantsT(concrete_msg); });
+            }
+
+            //! converts back to the variant, moving the message out; this CompactMessage is left empty
+            MessageVariantsT take() {
+                using TakeFunction = MessageVariantsT (*)(CompactMessage&);
+                static constexpr TakeFunction take_table[] = {&take_one<Ts>...};
+                if (valueless()) throw std::bad_variant_access();
+                MessageVariantsT msg = take_table[index_](*this);
+                reset();
+                return msg;
+            }
+
+        private:
+            static constexpr std::uint8_t valueless_index = 0xFF;
+
+            bool valueless() const {
+                return index_ == valueless_index;
+            }
+
+            template<typename T>
+            const T& get() const {
+                if constexpr (stored_inline<T>) {
+                    return *std::launder(reinterpret_cast<const T*>(storage));
+                } else {
+                    return *static_cast<const T*>(pooled());
+                }
+            }
+
+            template<typename T>
+            T& get() {
+                return const_cast<T&>(static_cast<const CompactMessage*>(this)->get<T>());
+            }
+
+            void* pooled() const {
+                void* pointer;
+                std::memcpy(&pointer, storage, sizeof(pointer));
+                return pointer;
+            }
+
+            template<typename U>
+            void emplace(U&& msg) {
+                using T = std::decay_t<U>;
+                if constexpr (stored_inline<T>) {
+                    new (storage) T(std::forward<U>(msg));
+                } else {
+                    void* block = SlotPool<T>::allocate();
+                    try {
+                        new (block) T(std::forward<U>(msg));
+                    } catch (...) {
+                        SlotPool<T>::release(block);
+                        throw;
+                    }
+                    std::memcpy(storage, &block, sizeof(block));
+                }
+                index_ = static_cast<std::uint8_t>(Static::variant_index<T, MessageVariantsT>::value);
+            }
+
+            void steal(CompactMessage& other) {
+                // inline alternatives are trivially copyable, and the pooled ones are a pointer: either way, copying the bytes moves the message
+                std::memcpy(storage, other.storage, InlineBytes);
+                index_ = other.index_;
+                other.index_ = valueless_index;
+            }
+
+            void reset() {
+                using DestroyFunction = void (*)(CompactMessage&);
+                static constexpr DestroyFunction destroy_table[] = {&destroy_one<Ts>...};
+                if (!valueless()) {
+                    destroy_table[index_](*this);
+                    index_ = valueless_index;
+                }
+            }
+
+            template<typename T, typename Visitor, typename ResultT>
+            static ResultT visit_one(const CompactMessage& self, Visitor& visitor) {
+                return visitor(self.get<T>());
+            }
+
+            template<typename T>
+            static MessageVariantsT take_one(CompactMessage& self) {
+                return MessageVariantsT(std::in_place_type<T>, std::move(self.get<T>()));
+            }
+
+            template<typename T>
+            static void copy_one(CompactMessage& self, const CompactMessage& other) {
+                self.emplace(other.get<T>());
+            }
+
+            template<typename T>
+            static void destroy_one(CompactMessage& self) {
+                if constexpr (!stored_inline<T>) {
+                    T* msg = &self.get<T>();
+                    msg->~T();
+                    SlotPool<T>::release(msg);
+                }
+            }
+
+            using CopyFunction = void (*)(CompactMessage&, const CompactMessage&);
+            static constexpr CopyFunction copy_table[] = {&copy_one<Ts>...};
+
+            alignas(inline_alignment) unsigned char storage[InlineBytes];
+            std::uint8_t index_ = valueless_index;
+    };
+
+    //! ParallelFanout - when, and how, Broker::publish splits a long list of handlers across threads.
+    //! See Broker::enable_parallel_fanout.
+    struct ParallelFanout {
+        //! message types with fewer parallel-safe handlers than this are delivered inline, as usual
+        std::size_t min_subscribers = 1000;
+        //! handlers per chunk of work
+        std::size_t chunk_size = 256;
+        //! pool threads; 0 means one less than the number of cores, since the publishing thread helps too
+        std::size_t threads = 0;
+    };
+
+    //! SubscribeOptions - optional promises that a subscriber makes about its handler.
+    struct SubscribeOptions {
+        //! the handler may run on a pool thread, concurrently with other handlers of the same message; see ParallelFanout
+        bool parallel_safe = false;
+        //! right after subscribing, call the handler with the cached last value(s), if any; see Broker::enable_last_value
+        bool replay_last_value = false;
+    };
+
+    //! ForkJoinPool - worker threads that help the calling thread to get through one large loop, in chunks.
+    //! The calling thread works on the chunks too, so a parallel_for issued from within a pool thread cannot deadlock:
+    //! in the worst case the caller does all the chunks itself.
+    class ForkJoinPool {
+        public:
+            using ChunkFunction = std::function<void(std::size_t begin, std::size_t end)>;
+
+            explicit ForkJoinPool(std::size_t num_threads) {
+                for (std::size_t i = 0; i < num_threads; ++i) {
+                    threads.emplace_back(&ForkJoinPool::run, this);
+                }
+            }
+
+            ~ForkJoinPool() {
+                {
+                    std::lock_guard<std::mutex> guard(mutex);
+                    running = false;
+                }
+                awaiter.notify_all();
+                for (auto& thread : threads) {
+                    thread.join();
+                }
+            }
+
+            ForkJoinPool(const ForkJoinPool&) = delete;
+            ForkJoinPool& operator=(const ForkJoinPool&) = delete;
+
+            //! calls body(begin, end) for consecutive ranges of [0, count), each at most chunk_size long,
+            //! and returns once all of them are done. The first exception thrown by body is re-thrown here.
+            void parallel_for(std::size_t count, std::size_t chunk_size, const ChunkFunction& body) {
+                auto job = std::make_shared<Job>(body, count, chunk_size > 0 ? chunk_size : 1);
+                {
+                    std::lock_guard<std::mutex> guard(mutex);
+                    jobs.push_back(job);
+                }
+                awaiter.notify_all();
+
+                job->work();
+                {
+                    // all the chunks are taken; stop handing this job to idle threads
+                    std::lock_guard<std::mutex> guard(mutex);
+                    jobs.erase(std::find(jobs.begin(), jobs.end(), job));
+                }
+                // threads that were done with this job may now turn to the next one
+                awaiter.notify_all();
+                while (job->remaining.load(std::memory_order_acquire) > 0) {
+                    std::this_thread::yield();
+                }
+                if (job->error) {
+                    std::rethrow_exception(job->error);
+                }
+            }
+
+        private:
+            struct Job {
+                const ChunkFunction& body;
+                const std::size_t count;
+                const std::size_t chunk_size;
+                std::atomic<std::size_t> next_chunk{0};
+                std::atomic<std::size_t> remaining;
+                std::atomic<bool> failed{false};
+                std::exception_ptr error;
+
+                Job(const ChunkFunction& body, std::size_t count, std::size_t chunk_size)
+                    : body(body), count(count), chunk_size(chunk_size), remaining((count + chunk_size - 1) / chunk_size) {}
+
+                //! claims and runs chunks until there are none left. Once a job is out of chunks, body is never touched again,
+                //! so a pool thread holding on to a finished job does not need the caller's body to be alive.
+                void work() {
+                    const std::size_t num_chunks = (count + chunk_size - 1) / chunk_size;
+                    std::size_t chunk;
+                    while ((chunk = next_chunk.fetch_add(1, std::memory_order_relaxed)) < num_chunks) {
+                        const std::size_t begin = chunk * chunk_size;
+                        try {
+                            body(begin, std::min(begin + chunk_size, count));
+                        } catch (...) {
+                            if (!failed.exchange(true)) {
+                                error = std::current_exception();
+                            }
+                        }
+                        remaining.fetch_sub(1, std::memory_order_acq_rel);
+                    }
+                }
+            };
+
+            void run() {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (true) {
+                    awaiter.wait(lock, [this] { return !jobs.empty() || !running; });
+                    if (!running) break;
+                    std::shared_ptr<Job> job = jobs.front();
+                    lock.unlock();
+                    job->work();
+                    lock.lock();
+                    // the job stays queued until its caller removes it; don't spin on it meanwhile
+                    if (!jobs.empty() && jobs.front() == job) {
+                        awaiter.wait(lock, [this, &job] { return jobs.empty() || jobs.front() != job || !running; });
+                    }
+                }
+            }
+
+            std::vector<std::thread> threads;
+            std::mutex mutex;
+            std::condition_variable awaiter;
+            std::deque<std::shared_ptr<Job>> jobs;
+            bool running = true;
+    };
+
+    //! SeqlockSlot - holds the latest value of a trivially copyable T. Writers never block readers, readers never block anything:
+    //! a reader that overlaps a write simply retries. Concurrent writers take turns on the odd/even sequence number.
+    //! The value is kept in relaxed atomic words, so that the racing copies are well-defined.
+    template<typename T>
+    class SeqlockSlot {
+        static_assert(std::is_trivially_copyable<T>::value, "SeqlockSlot needs a trivially copyable type");
+
+        public:
+            void store(const T& value) {
+                std::uint64_t sequence = version.load(std::memory_order_relaxed);
+                do {
+                    while (sequence & 1) {
+                        Static::cpu_relax();
+                        sequence = version.load(std::memory_order_relaxed);
+                    }
+                } while (!version.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire, std::memory_order_relaxed));
+                std::atomic_thread_fence(std::memory_order_release);
+
+                std::uint64_t buffer[num_words] = {};
+                std::memcpy(buffer, &value, sizeof(T));
+                for (std::size_t i = 0; i < num_words; ++i) {
+                    words[i].store(buffer[i], std::memory_order_relaxed);
+                }
+                version.store(sequence + 2, std::memory_order_release);
+            }
+
+            std::optional<T> load() const {
+                std::uint64_t buffer[num_words];
+                while (true) {
+                    const std::uint64_t before = version.load(std::memory_order_acquire);
+                    if (before == 0) return std::nullopt; // never written
+                    if (before & 1) {
+                        Static::cpu_relax();
+                        continue;
+                    }
+                    for (std::size_t i = 0; i < num_words; ++i) {
+                        buffer[i] = words[i].load(std::memory_order_relaxed);
+                    }
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (version.load(std::memory_order_relaxed) == before) break;
+                }
+                alignas(T) unsigned char bytes[sizeof(T)];
+                std::memcpy(bytes, buffer, sizeof(T));
+                return *std::launder(reinterpret_cast<const T*>(bytes));
+            }
+
+        private:
+            static constexpr std::size_t num_words = (sizeof(T) + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t);
+            std::atomic<std::uint64_t> version{0};
+            std::atomic<std::uint64_t> words[num_words] = {};
+    };
+
+    //! LockedSlot - holds the latest value of any other T, e.g. one with strings, behind a mutex.
+    template<typename T>
+    class LockedSlot {
+        public:
+            void store(const T& value) {
+                std::lock_guard<std::mutex> guard(mutex);
+                latest.reset();
+                latest.emplace(value);
+            }
+
+            std::optional<T> load() const {
+                std::lock_guard<std::mutex> guard(mutex);
+                return latest;
+            }
+
+        private:
+            mutable std::mutex mutex;
+            std::optional<T> latest;
+    };
+
+    //! the slot that the last-value cache uses for T: lock-free where the type allows it
+    template<typename T>
+    using LastValueSlot = std::conditional_t<std::is_trivially_copyable<T>::value, SeqlockSlot<T>, LockedSlot<T>>;
+
     // use template specialization to define the message types
     template<typename MessageVariantsT>
     class Broker {
         private:
             using HandlerFunction = std::function<void(const MessageVariantsT)>;
-            using HandlerList = std::list<HandlerFunction>;
-            std::unordered_map<std::type_index, HandlerList> handlers;
+            struct Handler {
+                HandlerFunction function;
+                bool parallel_safe;
+            };
+            using HandlerList = std::list<Handler>;
+
+            //! the handlers of one message type, split for a parallel fan-out, each part in the order of the list
+            struct FanoutSnapshot {
+                //! not parallel-safe: called one after another, on the publisher's thread
+                std::vector<const Handler*> inline_handlers;
+                //! parallel-safe: an array that can be split into chunks
+                std::vector<const Handler*> parallel;
+            };
+
+            //! all the handlers of one message type
+            struct HandlerSlot {
+                HandlerList list;
+                //! how many handlers in list are parallel-safe; publish() checks this before it looks at the snapshot. Written under the mutex.
+                std::atomic<std::size_t> parallel_count{0};
+                //! an immutable split of list, for the publisher and the pool threads to read while handlers may subscribe; see fanout_snapshot()
+                std::shared_ptr<const FanoutSnapshot> snapshot;
+                std::atomic<bool> snapshot_stale{false};
+            };
+            using TapFunction = std::function<void(const MessageVariantsT&)>;
+
+            //! a wiretap: sees every message, regardless of its type
+            struct Tap {
+                TapFunction visitor;
+                Sampler sampler;
+                const bool block_when_full;
+                std::atomic<std::uint64_t> dropped{0};
+                // the queue holds compact messages, so that a slot takes 40 bytes rather than a full variant's worth
+                std::unique_ptr<Dispatcher<CompactMessage<MessageVariantsT>>> dispatcher;
+
+                Tap(TapFunction visitor, const TapOptions& options)
+                    : visitor(std::move(visitor)), sampler(options.sampling), block_when_full(options.block_when_full) {
+                    if (options.async) {
+                        dispatcher = std::make_unique<Dispatcher<CompactMessage<MessageVariantsT>>>(
+                                [this](CompactMessage<MessageVariantsT>& msg) { this->visitor(msg.take()); }, options.dispatcher);
+                    }
+                }
+
+                void deliver(const MessageVariantsT& msg) {
+                    if (!sampler.admit()) return;
+                    if (!dispatcher) {
+                        visitor(msg);
+                    } else if (block_when_full) {
+                        dispatcher->push(CompactMessage<MessageVariantsT>(msg));
+                    } else if (!dispatcher->try_push(CompactMessage<MessageVariantsT>(msg))) {
+                        dropped.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+            };
+            using TapList = std::vector<Tap*>;
+
+            std::unordered_map<std::type_index, HandlerSlot> handlers;
+            //! copy-on-write, so that publish() reads the taps with one plain load: subscribe_all swaps in a new list, and
+            //! keeps the old one in tap_lists for any publish still walking it. Null while there are no taps.
+            std::atomic<const TapList*> taps{nullptr};
+            //! every list published so far, the current one last; and the taps themselves. Guarded by the mutex.
+            std::vector<std::unique_ptr<const TapList>> tap_lists;
+            std::vector<std::unique_ptr<Tap>> tap_owners;
             std::mutex mutex;
 
+            ParallelFanout fanout;
+            std::unique_ptr<ForkJoinPool> fanout_pool;
+
+            //! last-value cache of one message type; see enable_last_value
+            struct LastValueCacheBase {
+                virtual ~LastValueCacheBase() = default;
+                virtual void store(const MessageVariantsT& msg) = 0;
+                virtual void replay(const HandlerFunction& handler) const = 0;
+            };
+
+            template<typename T>
+            struct LastValueCache : LastValueCacheBase {
+                LastValueSlot<T> slot;
+
+                void store(const MessageVariantsT& msg) override {
+                    slot.store(*std::get_if<T>(&msg));
+                }
+
+                void replay(const HandlerFunction& handler) const override {
+                    if (auto value = slot.load()) handler(MessageVariantsT(std::move(*value)));
+                }
+            };
+
+            //! one slot per key. Not lock-free: publishing under a key seen before takes a shared lock for the lookup (an atomic
+            //! read-modify-write on the lock word, shared by all publishers of T), and then writes to that key's slot.
+            //! Only the first publish under a new key takes the exclusive lock.
+            template<typename T, typename Key>
+            struct KeyedLastValueCache : LastValueCacheBase {
+                std::function<Key(const T&)> key_of;
+                mutable std::shared_mutex mutex;
+                std::unordered_map<Key, std::unique_ptr<LastValueSlot<T>>> slots;
+
+                explicit KeyedLastValueCache(std::function<Key(const T&)> key_of) : key_of(std::move(key_of)) {}
+
+                void store(const MessageVariantsT& msg) override {
+                    const T& value = *std::get_if<T>(&msg);
+                    Key key = key_of(value);
+                    {
+                        std::shared_lock<std::shared_mutex> lock(mutex);
+                        auto it = slots.find(key);
+                        if (it != slots.end()) {
+                            it->second->store(value);
+                            return;
+                        }
+                    }
+                    std::unique_lock<std::shared_mutex> lock(mutex);
+                    auto& slot = slots[std::move(key)];
+                    if (!slot) slot = std::make_unique<LastValueSlot<T>>();
+                    slot->store(value);
+                }
+
+                std::optional<T> load(const Key& key) const {
+                    std::shared_lock<std::shared_mutex> lock(mutex);
+                    auto it = slots.find(key);
+                    if (it == slots.end()) return std::nullopt;
+                    return it->second->load();
+                }
+
+                void replay(const HandlerFunction& handler) const override {
+                    std::vector<T> values;
+                    {
+                        std::shared_lock<std::shared_mutex> lock(mutex);
+                        for (const auto& entry : slots) {
+                            if (auto value = entry.second->load()) values.push_back(std::move(*value));
+                        }
+                    }
+                    // outside the lock: the handler may well publish
+                    for (auto& value : values) {
+                        handler(MessageVariantsT(std::move(value)));
+                    }
+                }
+            };
+
+            //! holds back live deliveries to a subscriber while its cached values are being replayed: they are queued,
+            //! and delivered by the subscribing thread once the replay is done. No lock is held while the handler runs,
+            //! so the handler may publish T itself.
+            struct ReplayGate {
+                std::mutex mutex;
+                std::atomic<bool> done{false};
+                std::vector<MessageVariantsT> pending;
+            };
+
+            //! one per message type, in the order of the variant; null where the cache is not enabled
+            std::array<std::unique_ptr<LastValueCacheBase>, std::variant_size<MessageVariantsT>::value> last_values;
+
+            template<typename T>
+            static constexpr std::size_t index_of() {
+                constexpr std::size_t index = Static::variant_index<T, MessageVariantsT>::value;
+                static_assert(index < std::variant_size<MessageVariantsT>::value, "T must be one of the types in MsgTypesT variant. Add your specific message type to the variant type that parametrizes the Broker class.");
+                return index;
+            }
+
+            //! one flag per message type, in the order of the variant: is anyone listening? Kept up to date by refresh_listening().
+            std::array<std::atomic<bool>, std::variant_size<MessageVariantsT>::value> listening{};
+
+            //! the handlers, as of now, split for a parallel fan-out. Rebuilt lazily, on the first wide publish after a change,
+            //! so that subscribing or unsubscribing thousands of handlers does not walk the list thousands of times.
+            std::shared_ptr<const FanoutSnapshot> fanout_snapshot(HandlerSlot& slot) {
+                if (slot.snapshot_stale.load(std::memory_order_acquire)) {
+                    std::lock_guard<std::mutex> guard(mutex);
+                    if (slot.snapshot_stale.load(std::memory_order_relaxed)) {
+                        auto updated = std::make_shared<FanoutSnapshot>();
+                        updated->parallel.reserve(slot.parallel_count.load(std::memory_order_relaxed));
+                        for (const auto& handler : slot.list) {
+                            (handler.parallel_safe ? updated->parallel : updated->inline_handlers).push_back(&handler);
+                        }
+                        std::atomic_store(&slot.snapshot, std::shared_ptr<const FanoutSnapshot>(std::move(updated)));
+                        slot.snapshot_stale.store(false, std::memory_order_relaxed);
+                    }
+                }
+                return std::atomic_load(&slot.snapshot);
+            }
+
+            //! call with the mutex held, after any change to handlers or taps
+            void refresh_listening() {
+                refresh_listening(std::make_index_sequence<std::variant_size<MessageVariantsT>::value>());
+            }
+
+            template<std::size_t... Is>
+            void refresh_listening(std::index_sequence<Is...>) {
+                (refresh_listening_one<std::variant_alternative_t<Is, MessageVariantsT>>(Is), ...);
+            }
+
+            template<typename T>
+            void refresh_listening_one(std::size_t index) {
+                auto it = handlers.find(std::type_index(typeid(T)));
+                const bool has_handlers = it != handlers.end() && !it->second.list.empty();
+                listening[index].store(has_handlers || taps.load(std::memory_order_relaxed) || last_values[index], std::memory_order_relaxed);
+            }
+
         public:
+            using MessageVariants = MessageVariantsT;
             using HandlerID = std::pair<std::type_index, typename HandlerList::iterator>;
+            using TapID = const Tap*;
 
 
             // subscribe method to be used with directly defined already-capturing lambdas:
             template<typename T>
-            HandlerID subscribe(std::function<void(const T&)> handler) {
+            HandlerID subscribe(std::function<void(const T&)> handler, const SubscribeOptions& options = SubscribeOptions()) {
             //! static_assert is used to ensure that the message type is one of the supported types and helps at compile time to catch errors
             static_assert(Static::check_type_in_variant<T, MessageVariantsT>(), "T must be one of the types in MsgTypesT variant. Add your specific message type to the variant type that parametrizes the Broker class.");
 
-                std::lock_guard<std::mutex> guard(mutex);
                 auto wrappedHandler = [handler](const MessageVariantsT msg) {
                     if (const T *derived = std::get_if<T>(&msg)) {
                         handler(*derived);
                     }
                 };
-                auto& handlerList = handlers[std::type_index(typeid(T))];
-                auto it = handlerList.insert(handlerList.end(), wrappedHandler);
+                LastValueCacheBase* cache = options.replay_last_value ? last_values[index_of<T>()].get() : nullptr;
+                std::shared_ptr<ReplayGate> gate;
+                HandlerFunction liveHandler = wrappedHandler;
+                if (cache) {
+                    // until the replay is done, live messages queue up behind it; otherwise a message published meanwhile
+                    // could be delivered first, and then be overwritten by the older value from the cache
+                    gate = std::make_shared<ReplayGate>();
+                    liveHandler = [wrappedHandler, gate](const MessageVariantsT msg) {
+                        if (!gate->done.load(std::memory_order_acquire)) {
+                            std::lock_guard<std::mutex> guard(gate->mutex);
+                            if (!gate->done.load(std::memory_order_relaxed)) {
+                                gate->pending.push_back(msg);
+                                return;
+                            }
+                        }
+                        wrappedHandler(msg);
+                    };
+                }
+                typename HandlerList::iterator it;
+                {
+                    std::lock_guard<std::mutex> guard(mutex);
+                    auto& slot = handlers[std::type_index(typeid(T))];
+                    it = slot.list.insert(slot.list.end(), Handler{liveHandler, options.parallel_safe});
+                    if (options.parallel_safe) {
+                        slot.parallel_count.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    slot.snapshot_stale.store(true, std::memory_order_release);
+                    refresh_listening();
+                }
+                // outside the lock, so that the handler can publish, or subscribe.
+                // The cache is read only now, after the handler is visible to publishers, and publish() updates the cache
+                // before delivering: so every live message is either in the cache already, or queued at the gate, to be
+                // delivered after the replay, in the order it arrived. The handler may get a value twice, but ends with the current one.
+                if (cache) {
+                    cache->replay(wrappedHandler);
+                    std::vector<MessageVariantsT> pending;
+                    while (true) {
+                        {
+                            std::lock_guard<std::mutex> guard(gate->mutex);
+                            if (gate->pending.empty()) {
+                                gate->done.store(true, std::memory_order_release);
+                                break;
+                            }
+                            pending.swap(gate->pending);
+                        }
+                        // still outside the lock: whatever these publish queues up behind them
+                        for (const auto& msg : pending) {
+                            wrappedHandler(msg);
+                        }
+                        pending.clear();
+                    }
+                }
                 return {std::type_index(typeid(T)), it};
         }
 
 
     // simplified API that captures the class instance and method of that instance to call:
     template<typename T, typename ClassType>
-    HandlerID subscribe(ClassType* instance, void (ClassType::*memberFunction)(const T&)) {
+    HandlerID subscribe(ClassType* instance, void (ClassType::*memberFunction)(const T&), const SubscribeOptions& options = SubscribeOptions()) {
         return subscribe<T>([instance, memberFunction](const T& msg) {
             (instance->*memberFunction)(msg);
-        });
+        }, options);
+    }
+
+    //! wiretap: the visitor receives every published message once, whatever its type. Useful for logging, audit and debugging.
+    //! The tap runs before the type-specific handlers, so that a log shows the cause before its consequences.
+    //! With options.async set, the visitor runs on its own thread and receives a copy of the message; see Dispatcher.
+    //! Safe while other threads publish: a publish that is already running may miss the new tap.
+    TapID subscribe_all(TapFunction visitor, const TapOptions& options = TapOptions()) {
+        auto tap = std::make_unique<Tap>(std::move(visitor), options);
+        const TapID tapID = tap.get();
+        std::lock_guard<std::mutex> guard(mutex);
+        auto updated = std::make_unique<TapList>();
+        if (const TapList* current = taps.load(std::memory_order_relaxed)) *updated = *current;
+        updated->push_back(tap.get());
+        tap_owners.push_back(std::move(tap));
+        taps.store(updated.get(), std::memory_order_release);
+        tap_lists.push_back(std::move(updated));
+        refresh_listening();
+        return tapID;
     }
 
     void unsubscribe(const HandlerID& handlerID) {
         std::lock_guard<std::mutex> guard(mutex);
         auto it = handlers.find(handlerID.first);
         if (it != handlers.end()) {
-            it->second.erase(handlerID.second);
+            if (handlerID.second->parallel_safe) {
+                it->second.parallel_count.fetch_sub(1, std::memory_order_relaxed);
+            }
+            it->second.snapshot_stale.store(true, std::memory_order_release);
+            it->second.list.erase(handlerID.second);
+            refresh_listening();
             }
         }
 
+    //! opt-in: message types with at least config.min_subscribers parallel-safe handlers get those handlers called
+    //! in chunks, on a pool of threads. publish() still returns only once all of them are done, so for the publisher,
+    //! nothing changes. The handlers that are not parallel-safe are called first, inline, as usual.
+    //! Call this before publishing starts.
+    void enable_parallel_fanout(const ParallelFanout& config = ParallelFanout()) {
+        std::size_t threads = config.threads;
+        if (threads == 0) {
+            const unsigned cores = std::thread::hardware_concurrency();
+            threads = cores > 1 ? cores - 1 : 1;
+        }
+        std::lock_guard<std::mutex> guard(mutex);
+        fanout = config;
+        fanout_pool = std::make_unique<ForkJoinPool>(threads);
+    }
+
+    //! removes a wiretap. Like subscribe and unsubscribe, this must not run while other threads publish: the tap is
+    //! destroyed right away. An async tap delivers its whole queue before it is destroyed.
+    void unsubscribe(const TapID& tapID) {
+        std::unique_ptr<Tap> removed;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            auto found = std::find_if(tap_owners.begin(), tap_owners.end(), [tapID](const auto& tap) { return tap.get() == tapID; });
+            if (found == tap_owners.end()) return;
+            removed = std::move(*found);
+            tap_owners.erase(found);
+            // no publish is running, so none of the old lists are in use any more
+            tap_lists.clear();
+            if (!tap_owners.empty()) {
+                auto updated = std::make_unique<TapList>();
+                for (const auto& tap : tap_owners) updated->push_back(tap.get());
+                tap_lists.push_back(std::move(updated));
+            }
+            taps.store(tap_lists.empty() ? nullptr : tap_lists.back().get(), std::memory_order_release);
+            refresh_listening();
+        }
+        // the tap is destroyed here - outside the lock, since an async tap may take a while
+    }
+
+    //! how many messages an async tap has dropped because its queue was full; see TapOptions::block_when_full
+    std::uint64_t tap_dropped(const TapID& tapID) const {
+        return tapID->dropped.load(std::memory_order_relaxed);
+    }
+
+    //! opt-in, per message type: remember the most recently published T, so that modules that start late can get the
+    //! current state without asking for it; see SubscribeOptions::replay_last_value and last_value().
+    //! Trivially copyable types are cached in a lock-free seqlock slot; others behind a mutex. Call this before publishing starts.
+    template<typename T>
+    void enable_last_value() {
+        std::lock_guard<std::mutex> guard(mutex);
+        last_values[index_of<T>()] = std::make_unique<LastValueCache<T>>();
+        refresh_listening();
+    }
+
+    //! as above, but remembers the most recent T for each distinct key_of(msg), e.g. for each source of a reading.
+    //! The lookup by key takes a shared lock, so unlike the unkeyed cache, this one is not lock-free for the publishers.
+    template<typename T, typename KeyFunction>
+    void enable_last_value(KeyFunction key_of) {
+        using Key = std::decay_t<std::invoke_result_t<KeyFunction, const T&>>;
+        std::lock_guard<std::mutex> guard(mutex);
+        last_values[index_of<T>()] = std::make_unique<KeyedLastValueCache<T, Key>>(std::move(key_of));
+        refresh_listening();
+    }
+
+    //! the most recently published T; std::nullopt if there is none yet. Throws if the cache for T is not enabled.
+    template<typename T>
+    std::optional<T> last_value() const {
+        const auto* cache = dynamic_cast<const LastValueCache<T>*>(last_values[index_of<T>()].get());
+        if (!cache) throw std::runtime_error("last_value: no (unkeyed) last-value cache enabled for this message type");
+        return cache->slot.load();
+    }
+
+    //! the most recently published T under this key; std::nullopt if there is none yet. Throws if the keyed cache for T is not enabled.
+    //! Key must be named, and be the key type that the cache was enabled with, e.g. `last_value<Reading, std::string>("s1")`.
+    template<typename T, typename Key>
+    std::optional<T> last_value(const typename Static::type_identity<Key>::type& key) const {
+        const auto* cache = dynamic_cast<const KeyedLastValueCache<T, Key>*>(last_values[index_of<T>()].get());
+        if (!cache) throw std::runtime_error("last_value: no last-value cache with this key type enabled for this message type");
+        return cache->load(key);
+    }
+
+    //! cheap check, a single relaxed load: would a message of type T reach anyone - a handler, a wiretap, or a last-value cache?
+    //! Once the cache for T is enabled, this stays true: T must be built, so that late subscribers can get it.
+    template<typename T>
+    bool has_subscribers() const {
+        return listening[index_of<T>()].load(std::memory_order_relaxed);
+    }
+
+    //! publishes factory() - but only calls the factory if someone is listening for T.
+    //! Use this where building the message is expensive (string formatting, copying buffers) and often nobody listens.
+    template<typename T, typename Factory>
+    void publish_lazy(Factory&& factory) {
+        if (has_subscribers<T>()) {
+            publish(MessageVariantsT(std::in_place_type<T>, std::forward<Factory>(factory)()));
+        }
+    }
+
+    //! constructs T from args and publishes it, if someone is listening for T. Note that args themselves are still evaluated by the caller.
+    template<typename T, typename... Args>
+    void emplace(Args&&... args) {
+        if (has_subscribers<T>()) {
+            publish(MessageVariantsT(std::in_place_type<T>, std::forward<Args>(args)...));
+        }
+    }
+
     void publish(const MessageVariantsT msg) {
 
+        #ifdef CFABRIC_NO_HANDLERS_OK
+        if (!listening[msg.index()].load(std::memory_order_relaxed)) {
+            return; // no one is listening
+        }
+        #endif
+
+        if (const auto& cache = last_values[msg.index()]) {
+            cache->store(msg);
+        }
+
+        if (const TapList* current_taps = taps.load(std::memory_order_acquire)) {
+            for (Tap* tap : *current_taps) {
+                tap->deliver(msg);
+            }
+        }
+
         std::visit([this](const auto& concrete_msg) {
             using ConcreteType = std::decay_t<decltype(concrete_msg)>;
             auto it = handlers.find(std::type_index(typeid(ConcreteType)));
             if (it != handlers.end()) {
-                for (const auto& handler : it->second) {
-                    handler(MessageVariantsT(concrete_msg));
+                auto& slot = it->second;
+                // a narrow fan-out costs one relaxed load here, and never touches the snapshot
+                if (fanout_pool && slot.parallel_count.load(std::memory_order_relaxed) >= fanout.min_subscribers) {
+                    // the pool threads work on a snapshot: a handler may subscribe, and so change slot.list, meanwhile
+                    const auto snapshot = fanout_snapshot(slot);
+                    for (const Handler* handler : snapshot->inline_handlers) {
+                        handler->function(MessageVariantsT(concrete_msg));
+                    }
+                    const auto& parallel = snapshot->parallel;
+                    fanout_pool->parallel_for(parallel.size(), fanout.chunk_size, [&parallel, &concrete_msg](std::size_t begin, std::size_t end) {
+                        for (std::size_t i = begin; i < end; ++i) {
+                            parallel[i]->function(MessageVariantsT(concrete_msg));
+                        }
+                    });
+                    return;
+                }
+                for (const auto& handler : slot.list) {
+                    handler.function(MessageVariantsT(concrete_msg));
                 }
                 } else {
                 // Having no handlers is OK. This means that no one is listening.
@@ -120,6 +1380,99 @@ namespace Cfabric {
             }, msg);
         }
     }; // class Broker
+
+    //! Bridge - connects two brokers: forwards a declared subset of the source broker's messages to the target broker,
+    //! converting them to the target's message types where needed.
+    //! The source's publishers only run the (optional) filter and push the message into a lock-free queue; the bridge's own
+    //! dispatcher thread then publishes into the target. Whatever has queued up meanwhile crosses over in one batch,
+    //! with a single wake-up. Messages of one type arrive in the order in which they were published.
+    //!
+    //! To connect both ways, use two bridges - and make sure that no message can go around in a loop.
+    template<typename SourceBrokerT, typename TargetBrokerT>
+    class Bridge {
+        public:
+            using SourceVariantsT = typename SourceBrokerT::MessageVariants;
+            using TargetVariantsT = typename TargetBrokerT::MessageVariants;
+
+            Bridge(std::shared_ptr<SourceBrokerT> source, std::shared_ptr<TargetBrokerT> target,
+                   const DispatcherConfig& config = DispatcherConfig())
+                : source(std::move(source)), target(std::move(target)) {
+                if (!this->source || !this->target) throw std::runtime_error("Bridge: brokers cannot be null");
+                queue = std::make_unique<Dispatcher<CompactMessage<SourceVariantsT>>>(
+                        [this](CompactMessage<SourceVariantsT>& item) {
+                            SourceVariantsT msg = item.take();
+                            forwarders[msg.index()](msg);
+                        }, config);
+            }
+
+            //! stops forwarding; whatever is already queued is still delivered to the target
+            ~Bridge() {
+                for (const auto& subscription : subscriptions) {
+                    source->unsubscribe(subscription);
+                }
+                queue.reset();
+            }
+
+            Bridge(const Bridge&) = delete;
+            Bridge& operator=(const Bridge&) = delete;
+
+            //! forward T as it is; T must be a message type of both brokers. Each T can be forwarded only once per bridge.
+            template<typename T>
+            Bridge& forward() {
+                return forward<T>([](const T&) { return true; });
+            }
+
+            //! forward those T for which filter(msg) is true. The filter runs on the publisher's thread.
+            template<typename T, typename Filter>
+            Bridge& forward(Filter filter) {
+                return forward_as<T, T>([](T&& msg) { return std::move(msg); }, std::move(filter));
+            }
+
+            //! forward T as U: the target receives convert(msg). The conversion runs on the bridge's thread.
+            template<typename T, typename U, typename Converter>
+            Bridge& forward_as(Converter convert) {
+                return forward_as<T, U>(std::move(convert), [](const T&) { return true; });
+            }
+
+            template<typename T, typename U, typename Converter, typename Filter>
+            Bridge& forward_as(Converter convert, Filter filter) {
+                static_assert(Static::check_type_in_variant<U, TargetVariantsT>(), "U must be one of the types in the target broker's variant.");
+                constexpr std::size_t index = Static::variant_index<T, SourceVariantsT>::value;
+                static_assert(index < std::variant_size<SourceVariantsT>::value, "T must be one of the types in the source broker's variant.");
+
+                // the dispatcher thread may be calling forwarders[index] already; and forwarding twice would duplicate every message
+                if (forwarders[index]) throw std::runtime_error("Bridge: this message type is already being forwarded");
+
+                // set up the receiving end before any message can arrive
+                forwarders[index] = [target = target.get(), convert = std::move(convert)](SourceVariantsT& msg) mutable {
+                    target->publish(TargetVariantsT(std::in_place_type<U>, convert(std::move(*std::get_if<T>(&msg)))));
+                };
+
+                // not parallel-safe: the filter is the caller's code, and is documented to run on the publisher's thread
+                auto* queue_ptr = queue.get();
+                subscriptions.push_back(source->template subscribe<T>([queue_ptr, filter = std::move(filter)](const T& msg) {
+                    if (filter(msg)) {
+                        queue_ptr->push(CompactMessage<SourceVariantsT>(msg));
+                    }
+                }));
+                return *this;
+            }
+
+            //! blocks until everything forwarded so far has been published into the target broker
+            void flush() {
+                queue->flush();
+            }
+
+        private:
+            using ForwardFunction = std::function<void(SourceVariantsT&)>;
+
+            std::shared_ptr<SourceBrokerT> source;
+            std::shared_ptr<TargetBrokerT> target;
+            std::array<ForwardFunction, std::variant_size<SourceVariantsT>::value> forwarders;
+            std::vector<typename SourceBrokerT::HandlerID> subscriptions;
+            // last, so that it is gone before the forwarders and the target are
+            std::unique_ptr<Dispatcher<CompactMessage<SourceVariantsT>>> queue;
+    };
 } // namespace Cfabric
 
 
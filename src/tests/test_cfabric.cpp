@@ -2,6 +2,7 @@
 // #include <gtest/gtest-assertion-result.h>
 #include "cfabric.hpp"
 #include "demo_subsystem_1.hpp"
+#include <map>
 
 
 TEST(CFabricTest, ExampleTest1) {
@@ -66,4 +67,499 @@ TEST(CFabricTest, ManyResponses) {
     SPDLOG_INFO(result);
 }
 
+TEST(CFabricTest, SubscribeAllSeesEveryType) {
+    using namespace BigSystem::MySubsystems;
+    auto broker = std::make_shared<Cfabric::Broker<MsgTypes::MessageVariants>>();
+
+    std::vector<std::size_t> seen_indices;
+    auto tap = broker->subscribe_all([&seen_indices](const MsgTypes::MessageVariants& msg) {
+        seen_indices.push_back(msg.index());
+    });
+
+    broker->publish(MsgTypes::ping());
+    broker->publish(MsgTypes::question("s1", "?"));
+    broker->publish(MsgTypes::pleaseStop());
+    ASSERT_EQ(seen_indices, (std::vector<std::size_t>{0, 2, 6}));
+
+    broker->unsubscribe(tap);
+    broker->publish(MsgTypes::ping());
+    ASSERT_EQ(seen_indices.size(), 3u);
+}
+
+TEST(CFabricTest, SubscribeAllSampling) {
+    using namespace BigSystem::MySubsystems;
+    auto broker = std::make_shared<Cfabric::Broker<MsgTypes::MessageVariants>>();
+
+    int one_in_ten = 0;
+    int rate_limited = 0;
+    Cfabric::TapOptions every_tenth;
+    every_tenth.sampling = Cfabric::Sampling::one_in(10);
+    broker->subscribe_all([&one_in_ten](const MsgTypes::MessageVariants&) { one_in_ten++; }, every_tenth);
+    // a very slow bucket: only the initial burst gets through
+    Cfabric::TapOptions slow_bucket;
+    slow_bucket.sampling = Cfabric::Sampling::rate(1e-3, 5);
+    broker->subscribe_all([&rate_limited](const MsgTypes::MessageVariants&) { rate_limited++; }, slow_bucket);
+
+    for (int i = 0; i < 1000; i++) {
+        broker->publish(MsgTypes::ping());
+    }
+    ASSERT_EQ(one_in_ten, 100);
+    ASSERT_EQ(rate_limited, 5);
+}
+
+TEST(CFabricTest, SubscribeAllAsync) {
+    using namespace BigSystem::MySubsystems;
+    auto broker = std::make_shared<Cfabric::Broker<MsgTypes::MessageVariants>>();
+
+    const auto publisher_thread = std::this_thread::get_id();
+    std::atomic<int> received{0};
+    std::atomic<bool> ran_on_publisher_thread{false};
+    Cfabric::TapOptions options;
+    options.async = true;
+    auto tap = broker->subscribe_all([&](const MsgTypes::MessageVariants& msg) {
+        if (std::this_thread::get_id() == publisher_thread) ran_on_publisher_thread = true;
+        if (std::holds_alternative<MsgTypes::string>(msg)) received++;
+    }, options);
+
+    for (int i = 0; i < 100; i++) {
+        broker->publish(MsgTypes::string("main", std::to_string(i)));
+    }
+    // unsubscribing an async tap delivers the rest of its queue before returning
+    broker->unsubscribe(tap);
+    ASSERT_EQ(received, 100);
+    ASSERT_FALSE(ran_on_publisher_thread);
+}
+
+TEST(CFabricTest, CompactMessageLayout) {
+    using namespace BigSystem::MySubsystems;
+    using Compact = Cfabric::CompactMessage<MsgTypes::MessageVariants>;
+
+    static_assert(sizeof(Compact) <= 32, "CompactMessage should stay at half a cache line");
+    static_assert(sizeof(Compact) < sizeof(MsgTypes::MessageVariants), "CompactMessage should be smaller than the variant");
+    static_assert(Cfabric::Dispatcher<Compact>::slot_size() <= 40, "a queued CompactMessage should cost 8 bytes on top");
+    static_assert(Compact::stored_inline<MsgTypes::ping>);
+    static_assert(Compact::stored_inline<MsgTypes::pingTTL>);
+    static_assert(Compact::stored_inline<MsgTypes::pleaseStop>);
+    static_assert(!Compact::stored_inline<MsgTypes::string>);
+    static_assert(!Compact::layout[Cfabric::Static::variant_index<MsgTypes::question, MsgTypes::MessageVariants>::value].stored_inline);
+    SPDLOG_INFO("\n{}", Compact::layout_report());
+}
+
+TEST(CFabricTest, CompactMessageRoundTrip) {
+    using namespace BigSystem::MySubsystems;
+    using Compact = Cfabric::CompactMessage<MsgTypes::MessageVariants>;
+
+    Compact small(MsgTypes::pingTTL(5, 1, 2));
+    Compact large(MsgTypes::MessageVariants(MsgTypes::answer("s2", "42")));
+    ASSERT_EQ(small.index(), 1u);
+    ASSERT_EQ(small.get_if<MsgTypes::pingTTL>()->destination, 2);
+    ASSERT_EQ(large.get_if<MsgTypes::answer>()->content, "42");
+    ASSERT_EQ(large.get_if<MsgTypes::question>(), nullptr);
+
+    Compact copy = large;
+    Compact moved = std::move(large);
+    ASSERT_EQ(large.index(), std::variant_npos);
+    ASSERT_EQ(copy.visit([](const auto& msg) { return sizeof(msg); }), sizeof(MsgTypes::answer));
+
+    auto variant = moved.take();
+    ASSERT_EQ(std::get<MsgTypes::answer>(variant).source, "s2");
+    ASSERT_EQ(std::get<MsgTypes::answer>(copy.to_variant()).content, "42");
+}
+
+namespace {
+    //! a message whose copy throws, once
+    struct FailsToCopy {
+        static inline bool fail = true;
+        static inline const void* failed_at = nullptr;
+        std::string payload;
+
+        explicit FailsToCopy(std::string payload) : payload(std::move(payload)) {}
+        FailsToCopy(const FailsToCopy& other) : payload(other.payload) {
+            if (fail) {
+                fail = false;
+                failed_at = this;
+                throw std::runtime_error("copy failed");
+            }
+        }
+    };
+}
+
+TEST(CFabricTest, CompactMessageReleasesBlockOnThrow) {
+    using Compact = Cfabric::CompactMessage<std::variant<int, FailsToCopy>>;
+    const FailsToCopy msg("x");
+
+    ASSERT_THROW(Compact{msg}, std::runtime_error);
+    // the block of the failed copy went back to the pool, and is the next one handed out
+    Compact copy(msg);
+    ASSERT_EQ(copy.get_if<FailsToCopy>(), FailsToCopy::failed_at);
+    ASSERT_EQ(copy.get_if<FailsToCopy>()->payload, "x");
+}
+
+TEST(CFabricTest, ParallelFanout) {
+    using namespace BigSystem::MySubsystems;
+    auto broker = std::make_shared<Cfabric::Broker<MsgTypes::MessageVariants>>();
+    Cfabric::ParallelFanout fanout;
+    fanout.min_subscribers = 1000;
+    fanout.chunk_size = 100;
+    fanout.threads = 3;
+    broker->enable_parallel_fanout(fanout);
+
+    constexpr int num_subsystems = 10000;
+    std::atomic<int> parallel_calls{0};
+    int inline_calls = 0;
+    const auto publisher_thread = std::this_thread::get_id();
+    Cfabric::SubscribeOptions parallel_safe;
+    parallel_safe.parallel_safe = true;
+
+    for (int i = 0; i < num_subsystems; i++) {
+        broker->subscribe<MsgTypes::ping>([&parallel_calls](const MsgTypes::ping&) {
+            parallel_calls.fetch_add(1, std::memory_order_relaxed);
+        }, parallel_safe);
+    }
+    // handlers that did not declare themselves parallel-safe keep running on the publisher's thread
+    broker->subscribe<MsgTypes::ping>([&](const MsgTypes::ping&) {
+        if (std::this_thread::get_id() == publisher_thread) inline_calls++;
+    });
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < 10; i++) {
+        broker->publish(MsgTypes::ping());
+        // publish returns only once every handler is done
+        ASSERT_EQ(parallel_calls.load(), (i + 1) * num_subsystems);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+    ASSERT_EQ(inline_calls, 10);
+    SPDLOG_INFO("est. performance, parallel fan-out: {} responders: {:.1f} M calls/sec", num_subsystems, 1e-6 * 10 * num_subsystems / elapsed.count());
+}
+
+TEST(CFabricTest, PublishLazy) {
+    using namespace BigSystem::MySubsystems;
+    auto broker = std::make_shared<Cfabric::Broker<MsgTypes::MessageVariants>>();
+
+    int factory_calls = 0;
+    auto factory = [&factory_calls] {
+        factory_calls++;
+        return MsgTypes::string("main", "expensive " + std::to_string(factory_calls));
+    };
+
+    ASSERT_FALSE(broker->has_subscribers<MsgTypes::string>());
+    broker->publish_lazy<MsgTypes::string>(factory);
+    ASSERT_EQ(factory_calls, 0);
+
+    std::vector<std::string> received;
+    auto id = broker->subscribe<MsgTypes::string>([&received](const MsgTypes::string& msg) {
+        received.push_back(msg.content);
+    });
+    ASSERT_TRUE(broker->has_subscribers<MsgTypes::string>());
+    ASSERT_FALSE(broker->has_subscribers<MsgTypes::answer>());
+    broker->publish_lazy<MsgTypes::string>(factory);
+    broker->emplace<MsgTypes::string>("main", "emplaced");
+    ASSERT_EQ(received, (std::vector<std::string>{"expensive 1", "emplaced"}));
+
+    broker->unsubscribe(id);
+    ASSERT_FALSE(broker->has_subscribers<MsgTypes::string>());
+
+    // a wiretap listens to everything
+    auto tap = broker->subscribe_all([](const MsgTypes::MessageVariants&) {});
+    ASSERT_TRUE(broker->has_subscribers<MsgTypes::answer>());
+    broker->unsubscribe(tap);
+    ASSERT_FALSE(broker->has_subscribers<MsgTypes::answer>());
+}
+
+TEST(CFabricTest, LastValueCache) {
+    using namespace BigSystem::MySubsystems;
+    auto broker = std::make_shared<Cfabric::Broker<MsgTypes::MessageVariants>>();
+    broker->enable_last_value<MsgTypes::answer>();
+    // one pingTTL per source, cached lock-free
+    broker->enable_last_value<MsgTypes::pingTTL>([](const MsgTypes::pingTTL& msg) { return msg.source; });
+
+    ASSERT_FALSE(broker->last_value<MsgTypes::answer>().has_value());
+    ASSERT_TRUE(broker->has_subscribers<MsgTypes::answer>());
+    broker->publish(MsgTypes::answer("s2", "41"));
+    broker->publish(MsgTypes::answer("s2", "42"));
+    broker->publish(MsgTypes::pingTTL(1, 7, 100));
+    broker->publish(MsgTypes::pingTTL(1, 8, 200));
+    broker->publish(MsgTypes::pingTTL(1, 7, 101));
+    ASSERT_EQ(broker->last_value<MsgTypes::answer>()->content, "42");
+    ASSERT_EQ((broker->last_value<MsgTypes::pingTTL, int>(8)->destination), 200);
+    ASSERT_FALSE((broker->last_value<MsgTypes::pingTTL, int>(9).has_value()));
+
+    // the key is converted to the cache's key type
+    broker->enable_last_value<MsgTypes::thanks>([](const MsgTypes::thanks& msg) { return msg.source; });
+    broker->publish(MsgTypes::thanks("s1", "cheers"));
+    ASSERT_EQ((broker->last_value<MsgTypes::thanks, std::string>("s1")->content), "cheers");
+    ASSERT_THROW(broker->last_value<MsgTypes::question>(), std::runtime_error);
+
+    // a late subscriber gets the current state right away, without anyone re-publishing it
+    Cfabric::SubscribeOptions replay;
+    replay.replay_last_value = true;
+    std::vector<std::string> answers;
+    broker->subscribe<MsgTypes::answer>([&answers](const MsgTypes::answer& msg) { answers.push_back(msg.content); }, replay);
+    ASSERT_EQ(answers, (std::vector<std::string>{"42"}));
+
+    std::map<int, int> destinations;
+    broker->subscribe<MsgTypes::pingTTL>([&destinations](const MsgTypes::pingTTL& msg) { destinations[msg.source] = msg.destination; }, replay);
+    ASSERT_EQ(destinations, (std::map<int, int>{{7, 101}, {8, 200}}));
+
+    // without replay, nothing is delivered until the next publish
+    int plain_calls = 0;
+    broker->subscribe<MsgTypes::answer>([&plain_calls](const MsgTypes::answer&) { plain_calls++; });
+    ASSERT_EQ(plain_calls, 0);
+}
+
+TEST(CFabricTest, LastValueSeqlock) {
+    struct Reading {
+        std::uint64_t sequence;
+        std::uint64_t copy;
+        double payload[4];
+    };
+    Cfabric::SeqlockSlot<Reading> slot;
+    std::atomic<bool> done{false};
+
+    std::thread writer([&] {
+        for (std::uint64_t i = 1; i <= 100000; i++) {
+            slot.store(Reading{i, i, {0.0, 1.0, 2.0, 3.0}});
+        }
+        done = true;
+    });
+    std::uint64_t last_seen = 0;
+    while (!done) {
+        if (auto reading = slot.load()) {
+            // never a torn read, and never going back in time
+            ASSERT_EQ(reading->sequence, reading->copy);
+            ASSERT_GE(reading->sequence, last_seen);
+            last_seen = reading->sequence;
+        }
+    }
+    writer.join();
+    ASSERT_EQ(slot.load()->sequence, 100000u);
+}
+
+namespace OtherSubsystem {
+    struct Text {
+        std::string content;
+    };
+    using MessageVariants = std::variant<BigSystem::MySubsystems::MsgTypes::ping, Text>;
+}
+
+TEST(CFabricTest, BridgeForwardsAcrossBrokers) {
+    using namespace BigSystem::MySubsystems;
+    auto source = std::make_shared<Cfabric::Broker<MsgTypes::MessageVariants>>();
+    auto target = std::make_shared<Cfabric::Broker<OtherSubsystem::MessageVariants>>();
+
+    std::atomic<int> pings{0};
+    std::vector<std::string> texts;
+    std::atomic<bool> ran_on_publisher_thread{false};
+    const auto publisher_thread = std::this_thread::get_id();
+    target->subscribe<MsgTypes::ping>([&](const MsgTypes::ping&) {
+        if (std::this_thread::get_id() == publisher_thread) ran_on_publisher_thread = true;
+        pings++;
+    });
+    target->subscribe<OtherSubsystem::Text>([&texts](const OtherSubsystem::Text& msg) { texts.push_back(msg.content); });
+
+    {
+        Cfabric::Bridge<Cfabric::Broker<MsgTypes::MessageVariants>, Cfabric::Broker<OtherSubsystem::MessageVariants>> bridge(source, target);
+        bridge.forward<MsgTypes::ping>()
+              .forward_as<MsgTypes::answer, OtherSubsystem::Text>(
+                      [](MsgTypes::answer&& msg) { return OtherSubsystem::Text{msg.source + ": " + msg.content}; },
+                      [](const MsgTypes::answer& msg) { return msg.source != "noisy"; });
+
+        for (int i = 0; i < 1000; i++) {
+            source->publish(MsgTypes::ping());
+        }
+        source->publish(MsgTypes::answer("s2", "42"));
+        source->publish(MsgTypes::answer("noisy", "43"));
+        source->publish(MsgTypes::question("s1", "not forwarded"));
+        bridge.flush();
+        ASSERT_EQ(pings, 1000);
+        ASSERT_EQ(texts, (std::vector<std::string>{"s2: 42"}));
+
+        ASSERT_THROW(bridge.forward<MsgTypes::ping>(), std::runtime_error);
+        source->publish(MsgTypes::ping());
+        bridge.flush();
+        ASSERT_EQ(pings, 1001);
+
+        source->publish(MsgTypes::answer("s3", "44"));
+    }
+    // the bridge delivers what was queued before it went away, and then stops forwarding
+    ASSERT_EQ(texts.size(), 2u);
+    source->publish(MsgTypes::ping());
+    ASSERT_EQ(pings, 1001);
+    ASSERT_FALSE(ran_on_publisher_thread);
+}
+
+TEST(CFabricTest, SubscribeTapWhilePublishing) {
+    using namespace BigSystem::MySubsystems;
+    auto broker = std::make_shared<Cfabric::Broker<MsgTypes::MessageVariants>>();
+    broker->subscribe<MsgTypes::ping>([](const MsgTypes::ping&) {});
+
+    std::atomic<bool> done{false};
+    std::thread publisher([&] {
+        while (!done) {
+            broker->publish(MsgTypes::ping());
+        }
+    });
+    Cfabric::TapOptions async;
+    async.async = true;
+    std::atomic<int> seen{0};
+    std::vector<Cfabric::Broker<MsgTypes::MessageVariants>::TapID> taps;
+    for (int i = 0; i < 200; i++) {
+        taps.push_back(broker->subscribe_all([&seen](const MsgTypes::MessageVariants&) { seen++; }, i % 2 ? async : Cfabric::TapOptions()));
+        std::this_thread::yield();
+    }
+    done = true;
+    publisher.join();
+    // removing taps is not safe while publishing, so only once the publisher is done
+    for (const auto& tap : taps) {
+        broker->unsubscribe(tap);
+    }
+    ASSERT_GT(seen, 0);
+}
+
+TEST(CFabricTest, AsyncTapDropsWhenFull) {
+    using namespace BigSystem::MySubsystems;
+    auto broker = std::make_shared<Cfabric::Broker<MsgTypes::MessageVariants>>();
+    broker->subscribe<MsgTypes::ping>([](const MsgTypes::ping&) {});
+
+    std::mutex gate;
+    std::unique_lock<std::mutex> hold(gate);
+    std::atomic<int> received{0};
+    Cfabric::TapOptions options;
+    options.async = true;
+    options.dispatcher.capacity = 2;
+    auto tap = broker->subscribe_all([&](const MsgTypes::MessageVariants&) {
+        std::lock_guard<std::mutex> wait_for_test(gate);
+        received++;
+    }, options);
+
+    // the tap is stuck, so its queue fills up; the publisher must not wait for it
+    for (int i = 0; i < 10; i++) {
+        broker->publish(MsgTypes::ping());
+    }
+    const auto dropped = broker->tap_dropped(tap);
+    hold.unlock();
+    broker->unsubscribe(tap);
+    ASSERT_GT(dropped, 0u);
+    ASSERT_EQ(received + dropped, 10u);
+}
+
+TEST(CFabricTest, DispatcherFlushManyProducers) {
+    // the ring is packed: an int costs a sequence number, not a cache line
+    static_assert(Cfabric::Dispatcher<int>::slot_size() <= 2 * sizeof(std::size_t));
+
+    // a slow handler, so that flush() really has to wait
+    std::atomic<int> handled{0};
+    Cfabric::Dispatcher<int> dispatcher([&handled](int&) {
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+        handled++;
+    });
+
+    std::vector<std::thread> producers;
+    std::atomic<bool> failed{false};
+    for (int p = 0; p < 4; p++) {
+        producers.emplace_back([&] {
+            for (int i = 0; i < 50; i++) {
+                dispatcher.push(i);
+                const int pushed_by_me_at_least = i + 1;
+                dispatcher.flush();
+                // everything this thread pushed is handled once flush returns
+                if (handled.load() < pushed_by_me_at_least) failed = true;
+            }
+        });
+    }
+    for (auto& producer : producers) producer.join();
+    ASSERT_FALSE(failed);
+    ASSERT_EQ(handled, 200);
+}
+
+TEST(CFabricTest, CompactMessageAcrossThreads) {
+    using namespace BigSystem::MySubsystems;
+    using Compact = Cfabric::CompactMessage<MsgTypes::MessageVariants>;
+
+    // pooled blocks allocated on this thread, released on the dispatcher's, and recycled back here
+    std::atomic<int> total_length{0};
+    {
+        Cfabric::Dispatcher<Compact> dispatcher([&total_length](Compact& msg) {
+            total_length += static_cast<int>(msg.get_if<MsgTypes::string>()->content.size());
+        });
+        for (int i = 0; i < 10000; i++) {
+            dispatcher.push(Compact(MsgTypes::string("main", "0123456789")));
+        }
+    }
+    ASSERT_EQ(total_length, 100000);
+}
+
+TEST(CFabricTest, ParallelFanoutHandlerSubscribes) {
+    using namespace BigSystem::MySubsystems;
+    auto broker = std::make_shared<Cfabric::Broker<MsgTypes::MessageVariants>>();
+    Cfabric::ParallelFanout fanout;
+    fanout.min_subscribers = 10;
+    fanout.chunk_size = 4;
+    fanout.threads = 3;
+    broker->enable_parallel_fanout(fanout);
+
+    Cfabric::SubscribeOptions parallel_safe;
+    parallel_safe.parallel_safe = true;
+    std::atomic<int> calls{0};
+    std::function<void(const MsgTypes::ping&)> spawning = [&](const MsgTypes::ping&) {
+        calls++;
+        // handlers on pool threads subscribe more handlers of the very type being delivered
+        broker->subscribe<MsgTypes::ping>([&calls](const MsgTypes::ping&) { calls++; }, parallel_safe);
+    };
+    for (int i = 0; i < 64; i++) {
+        broker->subscribe<MsgTypes::ping>(spawning, parallel_safe);
+    }
+
+    broker->publish(MsgTypes::ping());
+    ASSERT_EQ(calls, 64);
+    // the handlers subscribed during the first publish take part in the next one
+    broker->publish(MsgTypes::ping());
+    ASSERT_EQ(calls, 64 + 128);
+}
+
+TEST(CFabricTest, LastValueReplayNotOvertaken) {
+    using namespace BigSystem::MySubsystems;
+    auto broker = std::make_shared<Cfabric::Broker<MsgTypes::MessageVariants>>();
+    broker->enable_last_value<MsgTypes::pingTTL>();
+    broker->publish(MsgTypes::pingTTL(1, 0, 1));
+
+    std::mutex received_mutex;
+    std::vector<int> received;
+    std::thread publisher;
+    Cfabric::SubscribeOptions replay;
+    replay.replay_last_value = true;
+    broker->subscribe<MsgTypes::pingTTL>([&](const MsgTypes::pingTTL& msg) {
+        if (msg.destination == 1) {
+            // while the cached value is being replayed, another thread publishes a newer one
+            publisher = std::thread([&broker] { broker->publish(MsgTypes::pingTTL(1, 0, 2)); });
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        std::lock_guard<std::mutex> guard(received_mutex);
+        received.push_back(msg.destination);
+    }, replay);
+    publisher.join();
+
+    // the newer value arrives last, so the subscriber ends up with the current state
+    ASSERT_EQ(received, (std::vector<int>{1, 2}));
+}
+
+TEST(CFabricTest, LastValueReplayedHandlerPublishes) {
+    using namespace BigSystem::MySubsystems;
+    auto broker = std::make_shared<Cfabric::Broker<MsgTypes::MessageVariants>>();
+    broker->enable_last_value<MsgTypes::pingTTL>();
+    broker->publish(MsgTypes::pingTTL(1, 0, 1));
+
+    std::vector<int> received;
+    Cfabric::SubscribeOptions replay;
+    replay.replay_last_value = true;
+    broker->subscribe<MsgTypes::pingTTL>([&](const MsgTypes::pingTTL& msg) {
+        received.push_back(msg.destination);
+        // the replayed value triggers a publish of the same type, from within the replay
+        if (msg.destination == 1) broker->publish(MsgTypes::pingTTL(1, 0, 2));
+    }, replay);
+
+    ASSERT_EQ(received, (std::vector<int>{1, 2}));
+    ASSERT_EQ(broker->last_value<MsgTypes::pingTTL>()->destination, 2);
+}
+
 // Add more test cases as needed
@@ -3,6 +3,9 @@
 #include "demo_subsystem_1.hpp"
 #include <chrono>
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include <spdlog/spdlog.h>
 
 TEST(CFabricPerformanceTest, ThreadedPingPong) {
@@ -30,3 +33,82 @@ TEST(CFabricPerformanceTest, ThreadedPingPong) {
 
     ASSERT_GT(pings_per_second, 100.0) << "Performance below threshold for threaded ping-pong";
     }
+
+namespace {
+    //! keeps the calling thread off the given cores for as long as it lives, so that it does not compete with a pinned dispatcher
+    class AvoidCores {
+        public:
+            explicit AvoidCores(const std::vector<int>& cores) {
+                #ifdef __linux__
+                if (cores.empty() || pthread_getaffinity_np(pthread_self(), sizeof(original), &original) != 0) return;
+                cpu_set_t allowed = original;
+                for (int core : cores) {
+                    CPU_CLR(core, &allowed);
+                }
+                // with nowhere else to go, stay where we are
+                restore = CPU_COUNT(&allowed) > 0 && pthread_setaffinity_np(pthread_self(), sizeof(allowed), &allowed) == 0;
+                #endif
+            }
+
+            ~AvoidCores() {
+                #ifdef __linux__
+                if (restore) pthread_setaffinity_np(pthread_self(), sizeof(original), &original);
+                #endif
+            }
+
+        private:
+            #ifdef __linux__
+            cpu_set_t original;
+            bool restore = false;
+            #endif
+    };
+
+    //! one-way latency from push() to the handler, with the queue kept empty, so that every message pays for the wake-up
+    std::vector<double> measure_dispatcher_latency(const Cfabric::DispatcherConfig& config, int num_messages) {
+        using Clock = std::chrono::steady_clock;
+        std::vector<double> latencies_us;
+        latencies_us.reserve(num_messages);
+        std::atomic<int> handled{0};
+        const AvoidCores producer_affinity(config.cpu_affinity);
+
+        Cfabric::Dispatcher<Clock::time_point> dispatcher([&](Clock::time_point& sent) {
+            latencies_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent).count());
+            handled.store(handled.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }, config);
+
+        for (int i = 0; i < num_messages; i++) {
+            dispatcher.push(Clock::now());
+            while (handled.load(std::memory_order_acquire) <= i) {
+                std::this_thread::yield();
+            }
+        }
+        dispatcher.flush();
+        std::sort(latencies_us.begin(), latencies_us.end());
+        return latencies_us;
+    }
+
+    void report_latency(const char* label, const std::vector<double>& sorted_us) {
+        auto percentile = [&sorted_us](double p) { return sorted_us[static_cast<std::size_t>(p * (sorted_us.size() - 1))]; };
+        SPDLOG_INFO("Dispatcher latency, {}: p50 {:.2f} us, p99 {:.2f} us, p99.9 {:.2f} us, max {:.2f} us",
+                    label, percentile(0.5), percentile(0.99), percentile(0.999), sorted_us.back());
+    }
+}
+
+TEST(CFabricPerformanceTest, DispatcherLatency) {
+    const int num_messages = 20000;
+
+    auto blocking = measure_dispatcher_latency(Cfabric::DispatcherConfig(), num_messages);
+    ASSERT_EQ(blocking.size(), static_cast<std::size_t>(num_messages));
+    report_latency("blocking", blocking);
+
+    // busy-polling only makes sense with a core to spare for the dispatcher thread
+    const unsigned cores = std::thread::hardware_concurrency();
+    if (cores < 2) {
+        SPDLOG_INFO("Dispatcher latency, busy-poll: skipped, needs at least 2 cores");
+        return;
+    }
+    auto config = Cfabric::DispatcherConfig::low_latency({static_cast<int>(cores - 1)});
+    auto busy_poll = measure_dispatcher_latency(config, num_messages);
+    ASSERT_EQ(busy_poll.size(), static_cast<std::size_t>(num_messages));
+    report_latency("busy-poll, pinned", busy_poll);
+}